@@ -0,0 +1,277 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_COMMAND_TEMPLATE_H
+#define ILMPCLIENT_ILMP_COMMAND_TEMPLATE_H
+
+#include <vector>
+
+#include <boost/static_assert.hpp>
+
+#include "IlmpStream.h"
+
+// Thrown when the arguments given to an IlmpTemplateCommand don't match the parameter
+// kinds of its template.
+struct IlmpParamKindException { };
+
+// IlmpCommandTemplate is a precompiled IlmpCommand for an rpc that is sent repeatedly. The
+// site and rpc name are encoded once; each command built from the template only adds the
+// pageview id and its arguments.
+//
+// 'kinds' lists the parameter kinds, one char per parameter:
+//   'p' plain text (std::string), 'j' json (JsonString), 'i' int, 'c' callback.
+//
+//   IlmpCommandTemplate say(stream, "chat.say", "pc");
+//   IlmpTemplateCommand cmd(say, pageviewId);
+//   cmd << text << callback;
+//   cmd.send();
+class IlmpCommandTemplate : boost::noncopyable
+{
+	friend class IlmpTemplateCommand;
+
+public:
+	IlmpCommandTemplate(IlmpStream* _stream, const std::string& rpc, const std::string& _kinds = "", const std::string& siteDir = "") :
+		stream(_stream), kinds(_kinds)
+	{
+		const std::string& site = siteDir == "" ? stream->siteDir : siteDir;
+		prefix.reserve(3 + site.size() + rpc.size());
+		prefix += '\002';
+		prefix += 'M';
+		prefix += site;
+		prefix += '|';
+		prefix += rpc;
+	}
+
+	const std::string& paramKinds() const { return kinds; }
+
+private:
+	IlmpStream* stream;
+	const std::string kinds;
+	std::string prefix; // "\002M" [site] "|" [rpc]
+};
+
+// A single command built from an IlmpCommandTemplate. Used like IlmpCommand, but each
+// argument is checked against the template's parameter kinds.
+class IlmpTemplateCommand : boost::noncopyable
+{
+public:
+	IlmpTemplateCommand(const IlmpCommandTemplate& _tpl, int _pageviewId = 1) :
+		tpl(_tpl), pageviewId(_pageviewId), param(0), buf(new std::string()), lastCb(0)
+	{
+		buf->reserve(16 + tpl.prefix.size() + 16 * tpl.kinds.size());
+		appendInt(pageviewId);
+		*buf += tpl.prefix;
+	}
+
+	~IlmpTemplateCommand() {
+		if (!buf)
+			return;
+
+		// Not sent, e.g. because a parameter didn't match: the server will never reference
+		// the callbacks this command registered, so drop them again.
+		for (size_t i = 0; i < registered.size(); i++)
+			tpl.stream->getCallback(registered[i]->pageviewId, registered[i]->id, true);
+		delete buf;
+	}
+
+	IlmpTemplateCommand& operator<<(int n) {
+		expect('i');
+		*buf += '\003';
+		*buf += 'j';
+		appendInt(n);
+		return *this;
+	}
+
+	IlmpTemplateCommand& operator<<(const JsonString& e) {
+		expect('j');
+		*buf += '\003';
+		*buf += 'j';
+		appendEscaped(e);
+		return *this;
+	}
+
+	IlmpTemplateCommand& operator<<(const std::string& s) {
+		expect('p');
+		*buf += '\003';
+		*buf += 'p';
+		appendEscaped(s);
+		return *this;
+	}
+
+	IlmpTemplateCommand& operator<<(boost::function<void(StringTokenWalker&) > cb)
+	{
+		if (!accepts('c'))
+			throw IlmpParamKindException(); // before wrapping, so nothing leaks
+		return operator<<(new IlmpCallbackNativeFunc(tpl.stream, pageviewId, cb));
+	}
+
+	// See IlmpCommand::operator<<(IlmpCallback*). On a kind mismatch, c is deleted unless it
+	// was registered before (and is thus owned by the stream already).
+	IlmpTemplateCommand& operator<<(IlmpCallback* c)
+	{
+		if (!accepts('c')) {
+			if (!c->id)
+				delete c;
+			throw IlmpParamKindException();
+		}
+		param++;
+
+		if (!c->id)
+			registered.push_back(c);
+		tpl.stream->registerCallback(c);
+		*buf += '\003';
+		*buf += 'c';
+		appendInt(c->id);
+		lastCb = c;
+		return *this;
+	}
+
+	// See IlmpCommand::operator>>.
+	IlmpTemplateCommand& operator>>(IlmpCallback** cbPtr)
+	{
+		if (lastCb) {
+			*cbPtr = lastCb;
+			lastCb->ptrs.push_back(cbPtr);
+		}
+		return *this;
+	}
+
+	// This object should not be used after send().
+	void send()
+	{
+		if (param != tpl.kinds.size())
+			throw IlmpParamKindException();
+
+		*buf += '\001';
+		std::string* data = buf;
+		buf = 0;
+		tpl.stream->writeOwned(data);
+	}
+
+private:
+	const IlmpCommandTemplate& tpl;
+	int pageviewId;
+	size_t param; // index of the next parameter
+	std::string* buf;
+	IlmpCallback *lastCb;
+	std::vector<IlmpCallback*> registered; // by this command, for cleanup if it isn't sent
+
+	bool accepts(char kind) const {
+		return param < tpl.kinds.size() && tpl.kinds[param] == kind;
+	}
+
+	void expect(char kind) {
+		if (!accepts(kind))
+			throw IlmpParamKindException();
+		param++;
+	}
+
+	void appendInt(int n) {
+		char digits[12];
+		char* p = digits + sizeof(digits);
+		unsigned int u = n < 0 ? 0u - (unsigned int)n : n;
+		do { *--p = '0' + u % 10; u /= 10; } while (u);
+		if (n < 0) *--p = '-';
+		buf->append(p, digits + sizeof(digits) - p);
+	}
+
+	// Appends s, replacing \x00..\x05 with {\x05 [ascii representation of 0..5]}, as
+	// IlmpCommand::escape does. Runs without escapes are appended in one go.
+	void appendEscaped(const std::string& s) {
+		const char* run = s.data();
+		const char* end = s.data() + s.size();
+		for (const char* p = run; p != end; p++) {
+			if (*p >= '\x00' && *p <= '\x05') {
+				buf->append(run, p - run);
+				*buf += '\x05';
+				*buf += (char)('0' + *p);
+				run = p + 1;
+			}
+		}
+		buf->append(run, end - run);
+	}
+};
+
+// Parameter kinds for IlmpRpc.
+struct IlmpNoParam { struct Arg { private: Arg(); }; static const char kind = 0; };
+struct IlmpPlainParam { typedef const std::string& Arg; static const char kind = 'p'; };
+struct IlmpJsonParam { typedef const JsonString& Arg; static const char kind = 'j'; };
+struct IlmpIntParam { typedef int Arg; static const char kind = 'i'; };
+struct IlmpCallbackParam { typedef IlmpCallback* Arg; static const char kind = 'c'; };
+
+// IlmpRpc is an IlmpCommandTemplate whose parameter kinds are given as types, so that
+// send() is checked at compile time.
+//
+//   IlmpRpc<IlmpPlainParam, IlmpCallbackParam> say(stream, "chat.say");
+//   say.send(pageviewId, text, callback);
+template <class P1 = IlmpNoParam, class P2 = IlmpNoParam, class P3 = IlmpNoParam, class P4 = IlmpNoParam>
+class IlmpRpc : public IlmpCommandTemplate
+{
+public:
+	IlmpRpc(IlmpStream* stream, const std::string& rpc, const std::string& siteDir = "") :
+		IlmpCommandTemplate(stream, rpc, kindString(), siteDir) {}
+
+	void send(int pageviewId) {
+		BOOST_STATIC_ASSERT(arity == 0);
+		IlmpTemplateCommand cmd(*this, pageviewId);
+		cmd.send();
+	}
+
+	void send(int pageviewId, typename P1::Arg a1) {
+		BOOST_STATIC_ASSERT(arity == 1);
+		IlmpTemplateCommand cmd(*this, pageviewId);
+		cmd << a1;
+		cmd.send();
+	}
+
+	void send(int pageviewId, typename P1::Arg a1, typename P2::Arg a2) {
+		BOOST_STATIC_ASSERT(arity == 2);
+		IlmpTemplateCommand cmd(*this, pageviewId);
+		cmd << a1 << a2;
+		cmd.send();
+	}
+
+	void send(int pageviewId, typename P1::Arg a1, typename P2::Arg a2, typename P3::Arg a3) {
+		BOOST_STATIC_ASSERT(arity == 3);
+		IlmpTemplateCommand cmd(*this, pageviewId);
+		cmd << a1 << a2 << a3;
+		cmd.send();
+	}
+
+	void send(int pageviewId, typename P1::Arg a1, typename P2::Arg a2, typename P3::Arg a3, typename P4::Arg a4) {
+		BOOST_STATIC_ASSERT(arity == 4);
+		IlmpTemplateCommand cmd(*this, pageviewId);
+		cmd << a1 << a2 << a3 << a4;
+		cmd.send();
+	}
+
+private:
+	static const int arity = (P1::kind != 0) + (P2::kind != 0) + (P3::kind != 0) + (P4::kind != 0);
+
+	// Parameters must be given in order; an IlmpNoParam can only be followed by more of them.
+	BOOST_STATIC_ASSERT(P1::kind != 0 || P2::kind == 0);
+	BOOST_STATIC_ASSERT(P2::kind != 0 || P3::kind == 0);
+	BOOST_STATIC_ASSERT(P3::kind != 0 || P4::kind == 0);
+
+	static std::string kindString() {
+		const char k[] = {P1::kind, P2::kind, P3::kind, P4::kind, 0};
+		return std::string(k);
+	}
+};
+
+#endif
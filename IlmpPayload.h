@@ -0,0 +1,402 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_PAYLOAD_H
+#define ILMPCLIENT_ILMP_PAYLOAD_H
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+#include <boost/config.hpp>
+
+#include "TokenWalker.h"
+
+class JsonCursor;
+
+// IlmpPayload is a view on the bytes of an incoming payload. IlmpStream points it into the
+// message it has split off the receive buffer, which only lives for the duration of the
+// callback, so a callback should copy out (str()) whatever it wants to keep.
+//
+// Payloads are escaped like outgoing data: \x00..\x05 are sent as {\x05 [ascii digit]}.
+// Unescaping is done lazily, on the first call to data() or size(), and only when the raw
+// bytes actually contain \x05; otherwise the raw buffer is returned as-is.
+class IlmpPayload {
+public:
+	IlmpPayload() : rawBegin(0), rawEnd(0), state(Plain) {}
+	IlmpPayload(const char* begin, const char* end) : rawBegin(begin), rawEnd(end), state(Unknown) {}
+	explicit IlmpPayload(const std::string& s) : rawBegin(s.data()), rawEnd(s.data() + s.size()), state(Unknown) {}
+
+	// Escaped bytes, exactly as received.
+	const char* rawData() const { return rawBegin; }
+	size_t rawSize() const { return rawEnd - rawBegin; }
+
+	bool escaped() const {
+		if (state == Unknown)
+			state = memchr(rawBegin, '\x05', rawSize()) ? Escaped : Plain;
+		return state != Plain;
+	}
+
+	// Unescaped bytes.
+	const char* data() const {
+		if (!escaped()) return rawBegin;
+		unescape();
+		return unescaped.data();
+	}
+
+	size_t size() const {
+		if (!escaped()) return rawSize();
+		unescape();
+		return unescaped.size();
+	}
+
+	std::string str() const {
+		return std::string(data(), size());
+	}
+
+	// On-demand JSON access; see JsonCursor. If the payload was escaped, the cursor points
+	// into this object's unescaped copy, so it is only valid as long as this IlmpPayload is
+	// neither destroyed nor assigned to (e.g. by PayloadTokenWalker::tryNext). Copies of it
+	// do not share the copy.
+	JsonCursor json() const;
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	// A view on a temporary would dangle right away.
+	BOOST_DELETED_FUNCTION(explicit IlmpPayload(const std::string&& s))
+#endif
+
+private:
+	enum State { Unknown, Plain, Escaped, Unescaped };
+
+	const char* rawBegin;
+	const char* rawEnd;
+
+	mutable State state;
+	mutable std::string unescaped;
+
+	// Inverse of IlmpCommand::escape.
+	void unescape() const {
+		if (state == Unescaped)
+			return;
+
+		unescaped.reserve(rawSize());
+		for (const char* p = rawBegin; p != rawEnd; p++) {
+			if (*p == '\x05' && p + 1 != rawEnd && p[1] >= '0' && p[1] <= '5')
+				unescaped += (char)(*++p - '0');
+			else
+				unescaped += *p;
+		}
+		state = Unescaped;
+	}
+};
+
+// JsonCursor gives on-demand access to a json text without building a DOM. A cursor points
+// at a single value; looking up a member or element scans forward over the text, skipping
+// sibling values without interpreting them. Nothing is allocated unless a string value is
+// copied out.
+//
+// The cursor does not validate the text. Malformed input yields invalid cursors and failed
+// get()s, never reads outside [begin, end).
+//
+//   JsonCursor msg = payload.json();
+//   std::string nick;
+//   if (msg["user"]["nick"].get(nick)) ...
+class JsonCursor {
+public:
+	enum Type { Invalid, Null, Bool, Number, String, Array, Object };
+
+	JsonCursor() : pos(0), end(0) {}
+	JsonCursor(const char* begin, const char* end_) : pos(skipSpace(begin, end_)), end(end_) {}
+	explicit JsonCursor(const std::string& s) : pos(skipSpace(s.data(), s.data() + s.size())), end(s.data() + s.size()) {}
+
+	Type type() const {
+		if (!pos || pos == end) return Invalid;
+		switch (*pos) {
+			case '{': return Object;
+			case '[': return Array;
+			case '"': return String;
+			case 't': case 'f': return Bool;
+			case 'n': return Null;
+			default: return (*pos == '-' || (*pos >= '0' && *pos <= '9')) ? Number : Invalid;
+		}
+	}
+
+	bool valid() const { return type() != Invalid; }
+	bool isNull() const { return type() == Null; }
+
+	// Value of member 'key' if this is an object; an invalid cursor otherwise.
+	JsonCursor operator[](const char* key) const {
+		JsonCursor k, v;
+		for (bool more = first(v, &k); more; more = next(v, &k))
+			if (k.equals(key)) return v;
+		return JsonCursor();
+	}
+
+	// Element 'index' if this is an array; an invalid cursor otherwise.
+	JsonCursor operator[](int index) const {
+		JsonCursor v;
+		if (type() != Array) return v;
+		for (bool more = first(v); more; more = next(v))
+			if (index-- == 0) return v;
+		return JsonCursor();
+	}
+
+	// Iteration over array elements or object members. For objects, 'key' (if non-null)
+	// receives the member name as a String cursor.
+	//
+	//   for (bool more = c.first(v, &k); more; more = c.next(v, &k)) ...
+	bool first(JsonCursor& value, JsonCursor* key = 0) const {
+		Type t = type();
+		if (t != Array && t != Object) return false;
+		return member(skipSpace(pos + 1, end), t == Object, value, key);
+	}
+
+	bool next(JsonCursor& value, JsonCursor* key = 0) const {
+		const char* p = skipSpace(skipValue(value.pos, end), end);
+		if (!p || p == end || *p != ',') return false;
+		return member(skipSpace(p + 1, end), type() == Object, value, key);
+	}
+
+	bool get(std::string& s) const {
+		if (type() != String) return false;
+		s.clear();
+		for (const char* p = pos + 1; p != end; p++) {
+			if (*p == '"') return true;
+			if (*p != '\\') { s += *p; continue; }
+			if (++p == end) return false;
+			switch (*p) {
+				case 'b': s += '\b'; break;
+				case 'f': s += '\f'; break;
+				case 'n': s += '\n'; break;
+				case 'r': s += '\r'; break;
+				case 't': s += '\t'; break;
+				case 'u': {
+					unsigned long cp;
+					if (end - p < 5 || !hex4(p + 1, cp)) return false;
+					p += 4;
+					if (cp >= 0xD800 && cp < 0xDC00) { // surrogate pair
+						unsigned long lo;
+						if (end - p < 7 || p[1] != '\\' || p[2] != 'u' || !hex4(p + 3, lo) || lo < 0xDC00 || lo > 0xDFFF) return false;
+						p += 6;
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					}
+					appendUtf8(s, cp);
+					break;
+				}
+				default: s += *p; // \" \\ \/
+			}
+		}
+		return false;
+	}
+
+	bool get(double& d) const {
+		char buf[64];
+		if (!number(buf, sizeof(buf))) return false;
+		d = strtod(buf, 0);
+		return true;
+	}
+
+	bool get(long& n) const {
+		char buf[64];
+		if (!number(buf, sizeof(buf))) return false;
+		n = strtol(buf, 0, 10);
+		return true;
+	}
+
+	bool get(int& n) const {
+		long l;
+		if (!get(l)) return false;
+		n = (int)l;
+		return true;
+	}
+
+	bool get(bool& b) const {
+		if (type() != Bool) return false;
+		b = *pos == 't';
+		return true;
+	}
+
+	// Compares a String value to s without allocating, unless the value contains escapes.
+	bool equals(const char* s) const {
+		if (type() != String) return false;
+		const char* p = pos + 1;
+		const char* q = s;
+		for (; p != end && *p != '"' && *p != '\\'; p++, q++)
+			if (*q == '\0' || *q != *p) return false;
+		if (p != end && *p == '\\') {
+			std::string decoded;
+			return get(decoded) && decoded == s;
+		}
+		return p != end && *q == '\0';
+	}
+
+	// The json text of this value, e.g. to hand a subtree to a full parser.
+	std::string raw() const {
+		const char* e = skipValue(pos, end);
+		return e ? std::string(pos, e) : std::string();
+	}
+
+private:
+	const char* pos; // first char of the value, or 0
+	const char* end; // end of the underlying text
+
+	bool member(const char* p, bool isObject, JsonCursor& value, JsonCursor* key) const {
+		if (!p || p == end || *p == ']' || *p == '}') return false;
+		if (isObject) {
+			JsonCursor k(p, end);
+			if (k.type() != String) return false;
+			p = skipSpace(skipValue(p, end), end);
+			if (!p || p == end || *p != ':') return false;
+			p = skipSpace(p + 1, end);
+			if (key) *key = k;
+		}
+		value = JsonCursor(p, end);
+		return value.valid();
+	}
+
+	bool number(char* buf, size_t bufSize) const {
+		if (type() != Number) return false;
+		const char* e = skipValue(pos, end);
+		if (!e || (size_t)(e - pos) >= bufSize) return false;
+		memcpy(buf, pos, e - pos);
+		buf[e - pos] = '\0';
+		return true;
+	}
+
+	static const char* skipSpace(const char* p, const char* end) {
+		while (p && p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+		return p;
+	}
+
+	// Returns a pointer just past the value starting at p, or 0 if it is not terminated.
+	static const char* skipValue(const char* p, const char* end) {
+		if (!p || p == end) return 0;
+
+		int depth = 0;
+		bool inString = false;
+		for (; p != end; p++) {
+			if (inString) {
+				if (*p == '\\') { if (++p == end) return 0; }
+				else if (*p == '"') {
+					inString = false;
+					if (depth == 0) return p + 1;
+				}
+			}
+			else if (*p == '"') inString = true;
+			else if (*p == '{' || *p == '[') depth++;
+			else if (*p == '}' || *p == ']') {
+				if (depth == 0) return p; // end of enclosing container
+				if (--depth == 0) return p + 1;
+			}
+			else if (depth == 0 && (*p == ',' || *p == ':' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+				return p;
+		}
+		return depth == 0 && !inString ? p : 0;
+	}
+
+	static bool hex4(const char* p, unsigned long& v) {
+		v = 0;
+		for (int i = 0; i < 4; i++) {
+			char c = p[i];
+			v <<= 4;
+			if (c >= '0' && c <= '9') v |= c - '0';
+			else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+			else return false;
+		}
+		return true;
+	}
+
+	static void appendUtf8(std::string& s, unsigned long cp) {
+		if (cp < 0x80) s += (char)cp;
+		else if (cp < 0x800) { s += (char)(0xC0 | (cp >> 6)); s += (char)(0x80 | (cp & 0x3F)); }
+		else if (cp < 0x10000) { s += (char)(0xE0 | (cp >> 12)); s += (char)(0x80 | ((cp >> 6) & 0x3F)); s += (char)(0x80 | (cp & 0x3F)); }
+		else { s += (char)(0xF0 | (cp >> 18)); s += (char)(0x80 | ((cp >> 12) & 0x3F)); s += (char)(0x80 | ((cp >> 6) & 0x3F)); s += (char)(0x80 | (cp & 0x3F)); }
+	}
+};
+
+// PayloadTokenWalker walks the separated fields of a payload as IlmpPayload views, so each
+// field is only unescaped when it is read and contains \x05. Empty fields are kept, like
+// the StringTokenWalker that IlmpStream hands to IlmpCallback::onData.
+class PayloadTokenWalker {
+public:
+	PayloadTokenWalker(const char* begin_, const char* end_, char _sep) : begin(begin_), pos(begin_), end(end_), sep(_sep), done(begin_ == end_) {}
+
+	// All fields, escaped and including separators.
+	const char* rawData() const { return begin; }
+	size_t rawSize() const { return end - begin; }
+
+	bool tryNext(IlmpPayload& field) {
+		if (done) {
+			field = IlmpPayload();
+			return false;
+		}
+		const char* e = (const char*)memchr(pos, sep, end - pos);
+		if (!e) {
+			e = end;
+			done = true;
+		}
+		field = IlmpPayload(pos, e);
+		pos = done ? end : e + 1;
+		return true;
+	}
+
+	bool tryNext(std::string& s, const std::string& def = "") {
+		IlmpPayload field;
+		if (tryNext(field)) {
+			s = field.str();
+			return true;
+		}
+		s = def;
+		return false;
+	}
+
+	bool tryNext(int& i, int def = 0) {
+		std::string s;
+		if (tryNext(s)) {
+			i = atoi(s.c_str());
+			return true;
+		}
+		i = def;
+		return false;
+	}
+
+	template<class T>
+	void next(T& i) {
+		if (!tryNext(i))
+			throw TokenExpectedException();
+	}
+
+	bool skip() {
+		IlmpPayload vd;
+		return tryNext(vd);
+	}
+
+private:
+	const char* begin;
+	const char* pos;
+	const char* end;
+	char sep;
+	bool done;
+};
+
+inline JsonCursor IlmpPayload::json() const {
+	return JsonCursor(data(), data() + size());
+}
+
+#endif
@@ -21,20 +21,29 @@
 
 #include <string>
 #include <iostream>
+#include <sstream>
 #include <map>
+#include <list>
+#include <algorithm>
 
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include "TokenWalker.h"
+#include "IlmpPayload.h"
+#include "TimerWheel.h"
 
 #define ILMP_VERSION "2.0"
 // This implementation is also compatible with 1.0 servers.
 
+// Defaults for the per-stream timing settings, in seconds. See IlmpStream::setPingInterval and friends.
 #define ILMP_PING_INTERVAL 60
+#define ILMP_PONG_TIMEOUT ILMP_PING_INTERVAL
+#define ILMP_CONNECT_TIMEOUT 0 // disabled
 
 using boost::asio::ip::tcp;
 
@@ -44,6 +53,8 @@ using boost::asio::ip::tcp;
 
 class IlmpStream;
 class IlmpCommand;
+class IlmpCommandTemplate;
+class IlmpTemplateCommand;
 
 // IlmpCallback. References to callbacks are kept in implementers of this structure. When
 // data for a callback received, ::onData is invoked. When there are no more server-side
@@ -51,6 +62,7 @@ class IlmpCommand;
 // clean up any resources the callback logic might need.
 class IlmpCallback {
 	friend class IlmpCommand;
+	friend class IlmpTemplateCommand;
 
 private:
 	// for each ptr in ptrs: *ptr == this
@@ -65,10 +77,26 @@ public:
 	IlmpCallback(IlmpStream* stream_, int pageviewId_) : stream(stream_), pageviewId(pageviewId_), id(0) {}
 
 	virtual void onData(StringTokenWalker& params) { }
+
+	// Receives the parameters as views on the incoming message, each unescaped only when
+	// read. The views are only valid during the call. By default, the parameters are
+	// copied and passed on to onData.
+	virtual void onDataView(PayloadTokenWalker& params) {
+		std::string message(params.rawData(), params.rawSize());
+		StringTokenWalker copy(message, '\004', true);
+		onData(copy);
+	}
 	virtual void onJsonData(const std::string& json) {
 		std::cerr << "ILMP: Ignoring json data: " << json << std::endl;
 	}
 
+	// Receives json data as a view on the incoming message; use json.json() to pull out
+	// fields without copying. The view is only valid during the call. By default, the
+	// data is passed on to onJsonData, escaped as received, like onData gets it.
+	virtual void onJsonView(const IlmpPayload& json) {
+		onJsonData(std::string(json.rawData(), json.rawSize()));
+	}
+
 	void cancel();
 	
 	virtual ~IlmpCallback() {
@@ -107,6 +135,8 @@ static int ids = 0;
 class IlmpStream : boost::noncopyable, public boost::enable_shared_from_this<IlmpStream>
 {
 	friend class IlmpCommand;
+	friend class IlmpCommandTemplate;
+	friend class IlmpTemplateCommand;
 
 private:
 	boost::asio::io_service& ioService; 
@@ -126,10 +156,22 @@ private:
 
 	bool pongWait;
 
-	// In the current implementation, resolver, socket and pingTimer have a similar lifespan.
+	// In the current implementation, resolver and socket have a similar lifespan.
 	tcp::resolver* resolver;
 	tcp::socket* socket;
-	boost::asio::deadline_timer* pingTimer;
+
+	// Timers are shared with all other streams on ioService through the TimerWheel service.
+	TimerWheel& timerWheel;
+	TimerWheel::Timer pingTimer;
+	TimerWheel::Timer pongTimer;
+	TimerWheel::Timer connectTimer;
+	TimerWheel::Timer reconnectTimer;
+
+	boost::posix_time::time_duration pingInterval;
+	boost::posix_time::time_duration pongTimeout;
+	boost::posix_time::time_duration connectTimeout;
+
+	int connectFailures; // subsequent reconnect() calls without a successful connect
 
 	boost::asio::streambuf response;
 
@@ -148,18 +190,37 @@ public:
 
 	IlmpStream(boost::asio::io_service& ioService, const std::string& _host, const std::string& _port = "80", const std::string& _siteDir = "") :
 			host(_host), port(_port), ioService(ioService), siteDir(_siteDir == "" ? _host : _siteDir), wasConnected(false), pongWait(false), respSeq(0),
-			resolver(0), socket(0), pingTimer(0), protocolVersion(0) {
+			resolver(0), socket(0), timerWheel(boost::asio::use_service<TimerWheel>(ioService)),
+			pingInterval(boost::posix_time::seconds(ILMP_PING_INTERVAL)), pongTimeout(boost::posix_time::seconds(ILMP_PONG_TIMEOUT)),
+			connectTimeout(boost::posix_time::seconds(ILMP_CONNECT_TIMEOUT)), connectFailures(0), protocolVersion(0) {
 		static int ids = 0;
 		id = ids++;
 	}
 
+	// Interval between pings. Takes effect from the next ping on.
+	void setPingInterval(const boost::posix_time::time_duration& d) {
+		pingInterval = d;
+	}
+
+	// Time the server gets to answer a ping before the connection is considered lost.
+	void setPongTimeout(const boost::posix_time::time_duration& d) {
+		pongTimeout = d;
+	}
+
+	// Time allowed for resolving and connecting; zero disables the timeout.
+	void setConnectTimeout(const boost::posix_time::time_duration& d) {
+		connectTimeout = d;
+	}
+
 	void connect()
 	{
 		close();
 
 		resolver = new tcp::resolver(ioService);
 		socket = new tcp::socket(ioService);
-		pingTimer = new boost::asio::deadline_timer(ioService);
+
+		if (connectTimeout > boost::posix_time::seconds(0))
+			timerWheel.arm(connectTimer, connectTimeout, boost::bind(&IlmpStream::onConnectTimeout, this->sharedPtr()));
 
 #ifdef ILMPDEBUG
 		std::cout << id << ": Connecting to " << host << " port " << port << "\n";
@@ -169,6 +230,23 @@ public:
 				boost::asio::placeholders::error, boost::asio::placeholders::iterator)); 
 	}
 
+	// Closes the stream and connects again after a delay that grows with the number of
+	// subsequent failures, as suggested by the spec: min(600, 3 * 2^failures) seconds.
+	// Intended to be called from onError.
+	void reconnect() {
+		close();
+
+		int delay = 600;
+		if (connectFailures < 8)
+			delay = std::min(delay, 3 << connectFailures);
+		connectFailures++;
+
+#ifdef ILMPDEBUG
+		std::cout << id << ": Reconnecting in " << delay << " seconds\n";
+#endif
+		timerWheel.arm(reconnectTimer, boost::posix_time::seconds(delay), boost::bind(&IlmpStream::connect, this->sharedPtr()));
+	}
+
 	void close() {
 		if (resolver) {
 			resolver->cancel();
@@ -183,11 +261,11 @@ public:
 			std::cout << id << ": Closed stream\n";
 #endif
 		}
-		if (pingTimer) {
-			pingTimer->cancel();
-			delete pingTimer;
-			pingTimer = 0;
-		}
+		timerWheel.cancel(pingTimer);
+		timerWheel.cancel(pongTimer);
+		timerWheel.cancel(connectTimer);
+		timerWheel.cancel(reconnectTimer);
+		pongWait = false;
 
 		int i = 0;
 		for (PageviewMap::iterator it = callbacks.begin(); it != callbacks.end(); it++) {
@@ -260,18 +338,33 @@ public:
 
 private:
 	void write(const std::string& data)
+	{
+		if (writable(data))
+			asyncWrite(new std::string(data));
+	}
+
+	// Like write, but takes ownership of a heap-allocated buffer instead of copying it.
+	void writeOwned(std::string* data)
+	{
+		if (writable(*data))
+			asyncWrite(data);
+		else
+			delete data;
+	}
+
+	bool writable(const std::string& data)
 	{
 #ifdef ILMPDEBUG
 		std::cout << " [ilmp:" << id << "] >> " << readable(data) << std::endl;
 #endif
 
-		if (!socket || !socket->is_open())
-			return;
-		
-		std::string* _data = new std::string(data);
+		return socket && socket->is_open();
+	}
 
-		boost::asio::async_write(*socket, boost::asio::buffer(*_data),
-				boost::bind(&IlmpStream::onWritten, this->sharedPtr(), _data, boost::asio::placeholders::error));
+	void asyncWrite(std::string* data)
+	{
+		boost::asio::async_write(*socket, boost::asio::buffer(*data),
+				boost::bind(&IlmpStream::onWritten, this->sharedPtr(), data, boost::asio::placeholders::error));
 	}
 
 	void onWritten(std::string* dataBuf, const boost::system::error_code& err)
@@ -297,6 +390,7 @@ private:
 			return;
 		else if (err) {
 			std::stringstream msg; msg << "Unable to resolve hostname " << host << ": " << err.message();
+			timerWheel.cancel(connectTimer);
 			handleError(ILMPERR_NETWORK, msg.str());
 			return;
 		}
@@ -324,11 +418,14 @@ private:
 		}
 		else if (err) {
 			std::cout << "Unable to connect to " << host << ":" << port << ": " << err.message();
+			timerWheel.cancel(connectTimer);
 			handleError(ILMPERR_NETWORK, err.message());
 			return;
 		}
 
 		wasConnected = true;
+		connectFailures = 0;
+		timerWheel.cancel(connectTimer);
 
 		// Connected
 		
@@ -341,10 +438,9 @@ private:
 		boost::asio::async_read_until(*socket, response, '\001', boost::bind(&IlmpStream::onData,
 				this->sharedPtr(), boost::asio::placeholders::error));
 	
-		// Schedule ping timer
-		pingTimer->expires_from_now(boost::posix_time::seconds(ILMP_PING_INTERVAL));
-		pingTimer->async_wait(boost::bind(&IlmpStream::onPingTimer,
-				this->sharedPtr(), boost::asio::placeholders::error));
+		// Schedule ping timer. The first interval is shortened by a per-stream phase, so pings
+		// of streams that connect simultaneously are spread out.
+		timerWheel.armSpread(pingTimer, pingInterval, boost::bind(&IlmpStream::onPingTimer, this->sharedPtr()));
 
 		if (onReady) onReady(); //ioService.post(onReady);
 	}
@@ -382,16 +478,15 @@ private:
 	}
 
 
-	void runCallback(IlmpCallback *c, std::string message)
+	void runCallback(IlmpCallback *c, const std::string& message)
 	{
 		if (message.size() > 0 && message.at(0) == '\005') {
-			// In the future, and when used extensively on larger json sets, we
-			// might want to prevent the .substr() here.
-			c->onJsonData(message.substr(1));
+			IlmpPayload json(message.data() + 1, message.data() + message.size());
+			c->onJsonView(json);
 		}
 		else {
-			StringTokenWalker params(message, '\004', true);
-			c->onData(params);
+			PayloadTokenWalker params(message.data(), message.data() + message.size(), '\004');
+			c->onDataView(params);
 		}
 	}
 
@@ -433,6 +528,7 @@ private:
 
 			if (command == "P") {
 				pongWait = false;
+				timerWheel.cancel(pongTimer);
 				continue;
 			}
 
@@ -489,31 +585,42 @@ private:
 		boost::asio::async_read_until(*socket, response, '\001', boost::bind(&IlmpStream::onData, this->sharedPtr(), boost::asio::placeholders::error));
 	}
 	
-	void onPingTimer(const boost::system::error_code& err) {
-		if (!pingTimer || err == boost::asio::error::operation_aborted)
-			return;
-		else if (err) {
-			std::cerr << "Error when invoking ping timer callback: " << err << std::endl;
-			return;
-		}
-
+	void onPingTimer() {
 		if (!socket || !socket->is_open()) {
 			// If the connection is lost, we have nothing to do here.
 			// The onConnect handler will reschedule us when we reconnect.
 			return;
 		}
 
-		if (pongWait) {
-			// We were still waiting on a pong for the previous ping.
-			handleError(ILMPERR_NETWORK, "Ping/pong timeout");
-			return;
+		// When the pong timeout exceeds the ping interval, don't stack up pings; the pong
+		// timer is still running for the outstanding one.
+		if (!pongWait) {
+			write("P\001");
+			pongWait = true;
+			timerWheel.arm(pongTimer, pongTimeout, boost::bind(&IlmpStream::onPongTimeout, this->sharedPtr()));
 		}
 
-		write("P\001");
-		pongWait = true;
+		timerWheel.rearm(pingTimer, pingInterval, boost::bind(&IlmpStream::onPingTimer, this->sharedPtr()));
+	}
+
+	void onPongTimeout() {
+		if (!socket || !pongWait)
+			return;
+
+		timerWheel.cancel(pingTimer);
+		handleError(ILMPERR_NETWORK, "Ping/pong timeout");
+	}
+
+	void onConnectTimeout() {
+		if (!socket)
+			return;
+
+		// Abort the pending resolve or connect; their handlers will see operation_aborted.
+		resolver->cancel();
+		socket->close();
 
-		pingTimer->expires_from_now(boost::posix_time::seconds(ILMP_PING_INTERVAL));
-		pingTimer->async_wait(boost::bind(&IlmpStream::onPingTimer, this->sharedPtr(), boost::asio::placeholders::error));
+		std::stringstream msg; msg << "Timeout while connecting to " << host << ":" << port;
+		handleError(ILMPERR_NETWORK, msg.str());
 	}
 
 	void handleError(int e, const std::string& str) {
@@ -0,0 +1,307 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_TIMER_WHEEL_H
+#define ILMPCLIENT_TIMER_WHEEL_H
+
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+// Length of a single wheel tick. Timers expire with this granularity.
+#ifndef ILMP_TIMER_RESOLUTION_MS
+#define ILMP_TIMER_RESOLUTION_MS 100
+#endif
+
+#define ILMP_TIMER_LEVELS	4
+#define ILMP_TIMER_SLOT_BITS	6
+#define ILMP_TIMER_SLOTS	(1 << ILMP_TIMER_SLOT_BITS)
+#define ILMP_TIMER_SLOT_MASK	(ILMP_TIMER_SLOTS - 1)
+
+// TimerWheel is a hierarchical timing wheel shared by all IlmpStreams that run on the same
+// io_service. Obtain it through boost::asio::use_service<TimerWheel>(ioService).
+//
+// Arming and cancelling a Timer is O(1); a timer that lies further away than one wheel
+// revolution sits in a coarser level and is cascaded down as its expiry approaches. With 4
+// levels of 64 slots and 100ms ticks, delays of up to ~19 days can be expressed; longer
+// delays are clamped.
+//
+// A single steady_timer drives the wheel. It is only set for the next tick at which a slot
+// is occupied or a coarser slot must be cascaded, so a 60s ping costs about two wakeups, not
+// one per tick. The wheel runs on the monotonic clock; wall clock changes do not affect it.
+//
+// The wheel is not synchronized: it, and hence all IlmpStreams on its io_service, must be
+// driven from a single thread (one thread calling ioService.run()).
+class TimerWheel : public boost::asio::io_service::service
+{
+public:
+	static boost::asio::io_service::id id;
+
+	// A Timer is owned by its user (usually as a member) and linked into the wheel while
+	// armed. The handler is released as soon as the timer fires or is cancelled, so it may
+	// safely hold a shared_ptr to the owner of the Timer.
+	class Timer : boost::noncopyable {
+		friend class TimerWheel;
+
+	public:
+		Timer() : prev(this), next(this), expiry(0), wheel(0) {}
+
+		~Timer() {
+			if (wheel) wheel->cancel(*this);
+		}
+
+		bool armed() const { return wheel != 0; }
+
+	private:
+		Timer* prev;
+		Timer* next;
+		boost::uint64_t expiry; // in ticks; kept after firing, for rearm()
+		TimerWheel* wheel; // non-null while armed
+		boost::function<void()> handler;
+
+		void unlink() {
+			prev->next = next;
+			next->prev = prev;
+			prev = next = this;
+		}
+	};
+
+	explicit TimerWheel(boost::asio::io_service& ioService) :
+			boost::asio::io_service::service(ioService), tickTimer(ioService), resolution(ILMP_TIMER_RESOLUTION_MS * 1000),
+			epoch(Clock::now()), current(0), scheduled(0), armedCount(0), ticking(false), inTick(false), spreadAt(0) {}
+
+	// (Re)arms t to invoke handler after delay. Any previously armed handler is dropped.
+	// The handler never runs early; it may run up to one tick late.
+	void arm(Timer& t, const boost::posix_time::time_duration& delay, const boost::function<void()>& handler) {
+		// Round the deadline up to a tick boundary.
+		boost::uint64_t deadline = elapsedMicroseconds() + std::max(delay.total_microseconds(), (boost::int64_t)1);
+		armAt(t, (deadline + resolution - 1) / resolution, handler);
+	}
+
+	// Like arm, but for the first expiry of a periodic timer: the delay is spread over one
+	// interval so that timers armed at the same moment (e.g. all streams connecting at
+	// startup) do not fire in lockstep. Continue the period with rearm().
+	void armSpread(Timer& t, const boost::posix_time::time_duration& interval, const boost::function<void()>& handler) {
+		// Additive (Weyl) sequence with a golden ratio step; consecutive phases land far apart.
+		spreadAt += 0x9E3779B97F4A7C15ULL;
+		armAt(t, elapsedTicks() + 1 + (spreadAt >> 32) % toTicks(interval), handler);
+	}
+
+	// Arms t for one interval after its previous expiry, so a periodic timer keeps its
+	// phase regardless of handler latency. Should be called for a timer that has fired.
+	void rearm(Timer& t, const boost::posix_time::time_duration& interval, const boost::function<void()>& handler) {
+		armAt(t, std::max(t.expiry + toTicks(interval), elapsedTicks() + 1), handler);
+	}
+
+	void cancel(Timer& t) {
+		if (!t.wheel)
+			return;
+
+		t.unlink();
+		t.wheel = 0;
+		armedCount--;
+
+		if (armedCount == 0 && ticking && !inTick) {
+			// Don't keep the io_service busy for nothing.
+			tickTimer.cancel();
+			ticking = false;
+		}
+
+		// Release the handler after unlinking; destroying it might destroy t's owner.
+		boost::function<void()> h;
+		h.swap(t.handler);
+	}
+
+private:
+	typedef boost::asio::steady_timer::clock_type Clock;
+
+	boost::asio::steady_timer tickTimer;
+	const boost::int64_t resolution; // in microseconds
+	const Clock::time_point epoch;
+
+	boost::uint64_t current; // ticks since epoch that have been processed
+	boost::uint64_t scheduled; // tick tickTimer is set for, while ticking
+	int armedCount;
+	bool ticking; // tickTimer is set
+	bool inTick; // onTick is running handlers
+	boost::uint64_t spreadAt;
+
+	Timer slots[ILMP_TIMER_LEVELS][ILMP_TIMER_SLOTS];
+		// list heads; level 0 holds the next ILMP_TIMER_SLOTS ticks
+
+	boost::uint64_t toTicks(const boost::posix_time::time_duration& d) const {
+		boost::int64_t ticks = (d.total_microseconds() + resolution - 1) / resolution;
+		return ticks < 1 ? 1 : ticks;
+	}
+
+	boost::uint64_t elapsedMicroseconds() const {
+		return boost::asio::chrono::duration_cast<boost::asio::chrono::microseconds>(Clock::now() - epoch).count();
+	}
+
+	boost::uint64_t elapsedTicks() const {
+		return elapsedMicroseconds() / resolution;
+	}
+
+	void armAt(Timer& t, boost::uint64_t expiry, const boost::function<void()>& handler) {
+		cancel(t);
+
+		if (!ticking) {
+			// Nothing is linked while idle, so we can skip ahead without walking the slots.
+			current = elapsedTicks();
+		}
+
+		t.expiry = expiry;
+		t.handler = handler;
+		t.wheel = this;
+		armedCount++;
+		boost::uint64_t due = place(t);
+
+		// Handlers run from onTick, which schedules the next tick once they are done.
+		if (!inTick && (!ticking || due < scheduled))
+			scheduleTick(due);
+	}
+
+	// Links t into the slot that corresponds to its expiry relative to the current tick.
+	// Returns the tick at which that slot is processed or cascaded.
+	boost::uint64_t place(Timer& t) {
+		boost::uint64_t delta = t.expiry > current ? t.expiry - current : 0;
+		const boost::uint64_t max = (boost::uint64_t(1) << (ILMP_TIMER_LEVELS * ILMP_TIMER_SLOT_BITS)) - 1;
+		if (delta > max) {
+			delta = max;
+			t.expiry = current + max;
+		}
+
+		int level = 0;
+		while (level < ILMP_TIMER_LEVELS - 1 && delta >= (boost::uint64_t(1) << ((level + 1) * ILMP_TIMER_SLOT_BITS)))
+			level++;
+
+		int shift = level * ILMP_TIMER_SLOT_BITS;
+		Timer& head = slots[level][(t.expiry >> shift) & ILMP_TIMER_SLOT_MASK];
+		t.prev = head.prev;
+		t.next = &head;
+		head.prev->next = &t;
+		head.prev = &t;
+
+		return (t.expiry >> shift) << shift;
+	}
+
+	// The first tick after 'current' at which an occupied slot is processed or cascaded.
+	boost::uint64_t nextDue() const {
+		boost::uint64_t next = current + (boost::uint64_t(1) << (ILMP_TIMER_LEVELS * ILMP_TIMER_SLOT_BITS));
+		for (int level = 0; level < ILMP_TIMER_LEVELS; level++) {
+			int shift = level * ILMP_TIMER_SLOT_BITS;
+			boost::uint64_t base = current >> shift;
+			for (int k = 1; k <= ILMP_TIMER_SLOTS && ((base + k) << shift) < next; k++) {
+				const Timer& head = slots[level][(base + k) & ILMP_TIMER_SLOT_MASK];
+				if (head.next != &head) {
+					next = (base + k) << shift;
+					break;
+				}
+			}
+		}
+		return next;
+	}
+
+	// Moves the contents of list head 'from' to 'to', leaving 'from' empty.
+	static void splice(Timer& from, Timer& to) {
+		if (from.next == &from) {
+			to.prev = to.next = &to;
+			return;
+		}
+		to.next = from.next;
+		to.prev = from.prev;
+		to.next->prev = &to;
+		to.prev->next = &to;
+		from.prev = from.next = &from;
+	}
+
+	// Re-places all timers of the given slot into finer levels. Returns the slot index.
+	int cascade(int level) {
+		int index = (current >> (level * ILMP_TIMER_SLOT_BITS)) & ILMP_TIMER_SLOT_MASK;
+		Timer pending;
+		splice(slots[level][index], pending);
+		while (pending.next != &pending) {
+			Timer& t = *pending.next;
+			t.unlink();
+			place(t);
+		}
+		return index;
+	}
+
+	// Setting the expiry cancels a pending wait; its handler then sees operation_aborted.
+	void scheduleTick(boost::uint64_t tick) {
+		ticking = true;
+		scheduled = tick;
+		tickTimer.expires_at(epoch + boost::asio::chrono::microseconds(tick * resolution));
+		tickTimer.async_wait(boost::bind(&TimerWheel::onTick, this, boost::asio::placeholders::error));
+	}
+
+	void onTick(const boost::system::error_code& err) {
+		if (err == boost::asio::error::operation_aborted)
+			return; // rescheduled or idle
+
+		inTick = true;
+		boost::uint64_t target = elapsedTicks();
+		while (current < target && armedCount > 0) {
+			current++;
+
+			int level = 1;
+			if ((current & ILMP_TIMER_SLOT_MASK) == 0)
+				while (level < ILMP_TIMER_LEVELS && cascade(level) == 0)
+					level++;
+
+			// Detach the due slot first: handlers may arm or cancel any timer, including
+			// ones in this very list.
+			Timer due;
+			splice(slots[0][current & ILMP_TIMER_SLOT_MASK], due);
+			while (due.next != &due) {
+				Timer& t = *due.next;
+				t.unlink();
+				t.wheel = 0;
+				armedCount--;
+
+				boost::function<void()> h;
+				h.swap(t.handler);
+				h(); // t may be destroyed from here on
+			}
+		}
+		inTick = false;
+
+		if (armedCount > 0)
+			scheduleTick(nextDue());
+		else
+			ticking = false;
+	}
+
+	void shutdown_service() {
+		// Drop all handlers without invoking them, like the other io_service services do.
+		for (int level = 0; level < ILMP_TIMER_LEVELS; level++)
+			for (int index = 0; index < ILMP_TIMER_SLOTS; index++)
+				while (slots[level][index].next != &slots[level][index])
+					cancel(*slots[level][index].next);
+	}
+};
+
+boost::asio::io_service::id TimerWheel::id;
+
+#endif
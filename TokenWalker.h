@@ -19,6 +19,11 @@
 #ifndef ILMPCLIENT_TOKEN_WALKER_H
 #define ILMPCLIENT_TOKEN_WALKER_H
 
+#include <string>
+#include <cstdlib>
+#include <iterator>
+
+#include <boost/asio/streambuf.hpp>
 #include <boost/tokenizer.hpp>
 
 struct TokenExpectedException { };